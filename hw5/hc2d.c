@@ -1,7 +1,113 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
-
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+
+enum { SCHEME_FWD_EULER, SCHEME_ADI, SCHEME_BWD_EULER, SCHEME_RKC };
+enum { SOLVER_GS_RB, SOLVER_GS, SOLVER_JACOBI, SOLVER_GS_ADI, SOLVER_MG, SOLVER_CG };
+enum { MG_CYCLE_V, MG_CYCLE_F };
+enum { MG_SMOOTH_GS_RB, MG_SMOOTH_JACOBI };
+enum { CG_PRECOND_NONE, CG_PRECOND_JACOBI, CG_PRECOND_MG };
+enum { ACCEL_NONE, ACCEL_CHEBYSHEV };
+
+// Optional "key value" lines after the four lines of input2d1.in:
+//   scheme  fwd_euler | adi | bwd_euler | rkc
+//   dt      <value>        (default: the explicit limit 0.25*min(dx,dy)^2/kdiff;
+//                           for rkc the first step, adapted afterwards)
+//   sts_tol <value>        (rkc: local error tolerance, default 1e-4; 0 keeps dt fixed)
+//   checkpoint_every <n>   (steps between checkpoints, default 0: none)
+//   checkpoint_keep  <n>   (checkpoints kept on disk, default 2)
+//   restart <file> | latest   (resume from a checkpoint instead of the initial condition)
+//   text_dump <it>         (full-precision dump after step it to serial_solution_t<it+1>.txt, default -1: none)
+//   solver  gs_rb | gs | jacobi | gs_adi | mg | cg   (linear solver for bwd_euler)
+//   omega   <value>        (relaxation factor of gs_rb and of the mg smoother, default 1;
+//                           use about 0.8 with mg_smoother jacobi)
+//   mg_cycle     v | f
+//   mg_smoother  gs_rb | jacobi
+//   mg_sweeps    <n>       (pre- and post-smoothing sweeps per level, default 2)
+//   cg_precond   jacobi | mg | none
+//   check_every  <n>       (gs_rb, gs, jacobi: test convergence every n sweeps, default 1)
+//   accel        none | chebyshev   (Chebyshev acceleration of jacobi and gs_rb)
+typedef struct
+{
+  int scheme;
+  double dt;
+  int solver;
+  double omega;
+  int mg_cycle, mg_smoother, mg_sweeps;
+  int cg_precond;
+  int check_every, accel;
+  double sts_tol;
+  int checkpoint_every, checkpoint_keep;
+  char restart[64];
+  int text_dump;
+} run_options;
+
+void read_options(FILE *fid, run_options *opts)
+{
+  char key[64], val[64];
+
+  opts->scheme = SCHEME_FWD_EULER;
+  opts->dt = 0.0;
+  opts->solver = SOLVER_GS_RB;
+  opts->omega = 1.0;
+  opts->mg_cycle = MG_CYCLE_V;
+  opts->mg_smoother = MG_SMOOTH_GS_RB;
+  opts->mg_sweeps = 2;
+  opts->cg_precond = CG_PRECOND_JACOBI;
+  opts->check_every = 1;
+  opts->accel = ACCEL_NONE;
+  opts->sts_tol = 1.0e-4;
+  opts->checkpoint_every = 0;
+  opts->checkpoint_keep = 2;
+  opts->restart[0] = '\0';
+  opts->text_dump = -1;
+
+  while(fscanf(fid, "%63s %63s", key, val) == 2)
+  {
+    if(strcmp(key, "scheme") == 0)
+      opts->scheme = (strcmp(val, "adi") == 0) ? SCHEME_ADI :
+                     (strcmp(val, "bwd_euler") == 0) ? SCHEME_BWD_EULER :
+                     (strcmp(val, "rkc") == 0) ? SCHEME_RKC : SCHEME_FWD_EULER;
+    else if(strcmp(key, "dt") == 0)
+      opts->dt = atof(val);
+    else if(strcmp(key, "solver") == 0)
+      opts->solver = (strcmp(val, "gs") == 0) ? SOLVER_GS :
+                     (strcmp(val, "jacobi") == 0) ? SOLVER_JACOBI :
+                     (strcmp(val, "gs_adi") == 0) ? SOLVER_GS_ADI :
+                     (strcmp(val, "mg") == 0) ? SOLVER_MG :
+                     (strcmp(val, "cg") == 0) ? SOLVER_CG : SOLVER_GS_RB;
+    else if(strcmp(key, "omega") == 0)
+      opts->omega = atof(val);
+    else if(strcmp(key, "mg_cycle") == 0)
+      opts->mg_cycle = (strcmp(val, "f") == 0) ? MG_CYCLE_F : MG_CYCLE_V;
+    else if(strcmp(key, "mg_smoother") == 0)
+      opts->mg_smoother = (strcmp(val, "jacobi") == 0) ? MG_SMOOTH_JACOBI : MG_SMOOTH_GS_RB;
+    else if(strcmp(key, "mg_sweeps") == 0)
+      opts->mg_sweeps = atoi(val);
+    else if(strcmp(key, "cg_precond") == 0)
+      opts->cg_precond = (strcmp(val, "mg") == 0) ? CG_PRECOND_MG :
+                         (strcmp(val, "none") == 0) ? CG_PRECOND_NONE : CG_PRECOND_JACOBI;
+    else if(strcmp(key, "check_every") == 0)
+      opts->check_every = atoi(val);
+    else if(strcmp(key, "accel") == 0)
+      opts->accel = (strcmp(val, "chebyshev") == 0) ? ACCEL_CHEBYSHEV : ACCEL_NONE;
+    else if(strcmp(key, "sts_tol") == 0)
+      opts->sts_tol = atof(val);
+    else if(strcmp(key, "checkpoint_every") == 0)
+      opts->checkpoint_every = atoi(val);
+    else if(strcmp(key, "checkpoint_keep") == 0)
+      opts->checkpoint_keep = atoi(val);
+    else if(strcmp(key, "restart") == 0)
+      strcpy(opts->restart, val);
+    else if(strcmp(key, "text_dump") == 0)
+      opts->text_dump = atoi(val);
+    else
+      printf("Ignoring unknown option %s\n", key);
+  }
+}
 
 void grid(int nx, double xst, double xen, double *x, double *dx)
 {
@@ -46,39 +152,330 @@ void set_initial_condition(int nx, int ny, double *x, double *y, double **T, dou
   enforce_bcs(nx,ny,x,y,T); //ensure BCs are satisfied at t = 0
 }
 
-void timestep_FwdEuler(int nx, int ny, double dt, double dx, double dy, double kdiff, double *x, double *y, double **T, double **rhs)
+// Rows of a 2D array allocated as one contiguous block, so that T[i][j] and
+// T[i+1][j] are exactly ny doubles apart
+double **alloc_2d(int nx, int ny)
+{
+  int i;
+  double **a = (double **)malloc(nx * sizeof(double *));
+
+  a[0] = (double *)calloc((size_t)nx * ny, sizeof(double));
+  for(i = 1; i < nx; i++)
+    a[i] = a[0] + (size_t)i * ny;
+  return a;
+}
+
+void free_2d(double **a)
+{
+  free(a[0]);
+  free(a);
+}
+
+// Fused (Forward) Euler step: Tnew = T + dt*kdiff*lap(T) in a single pass,
+// with the coefficients precomputed. The caller swaps T and Tnew afterwards.
+// The j loop is unit stride over restrict-qualified rows so that it
+// vectorizes (e.g. -O3 -march=native for AVX2/AVX-512).
+void timestep_FwdEuler(int nx, int ny, double dt, double dx, double dy, double kdiff, double *x, double *y, double **T, double **Tnew)
 {
 
   int i,j;
-  double dxsq = dx*dx, dysq = dy*dy;
-  // (Forward) Euler scheme
-  for(i=1; i<nx-1; i++)
-   for(j=1; j<ny-1; j++)
-     rhs[i][j] = kdiff*(T[i+1][j]+T[i-1][j]-2.0*T[i][j])/dxsq +
-           kdiff*(T[i][j+1]+T[i][j-1]-2.0*T[i][j])/dysq ;  // compute rhs
+  double ax = kdiff*dt/(dx*dx), ay = kdiff*dt/(dy*dy);
 
   for(i=1; i<nx-1; i++)
-   for(j=1; j<ny-1; j++)
-     T[i][j] = T[i][j] + dt*rhs[i][j];                           // update T^(it+1)[i]
+  {
+    const double *restrict t  = T[i];
+    const double *restrict tl = T[i-1];
+    const double *restrict tr = T[i+1];
+    double *restrict tn = Tnew[i];
+
+    for(j=1; j<ny-1; j++)
+      tn[j] = t[j] + ax*(tr[j] + tl[j] - 2.0*t[j]) + ay*(t[j+1] + t[j-1] - 2.0*t[j]);
+  }
 
   // set Dirichlet BCs
-  enforce_bcs(nx,ny,x,y,T);
+  enforce_bcs(nx,ny,x,y,Tnew);
 
 }
 
-double get_error_norm_2d(int nx, int ny, double **arr1, double **arr2)
+// Runge-Kutta-Chebyshev super-time-stepping (second-order RKC of Sommeijer,
+// Shampine and Verwer). A step of s stages costs s evaluations of the
+// Laplacian, like s Forward Euler steps, but is stable up to
+// dt*rho <= 0.653 s^2, rho = 4 kdiff (1/dx^2 + 1/dy^2) being the spectral
+// radius of the discrete operator, so long steps need only O(sqrt(dt)) work.
+// s is taken from dt and rho; dt is adapted to keep the local error estimate
+// of the RKC code below tol, or fixed when tol is 0. Stage j is
+//   Y_j = (1-mu_j-nu_j) Y_0 + mu_j Y_{j-1} + nu_j Y_{j-2} + mut_j dt F(Y_{j-1}) + gt_j dt F(Y_0)
+// and only reads Y_{j-2} at its own point, so it overwrites that buffer.
+#define RKC_MAX_STAGES 250
+
+typedef struct
+{
+  int nx, ny;
+  double kx, ky, rho;    // kdiff/dx^2, kdiff/dy^2 and the spectral radius
+  double tol;            // relative and absolute error tolerance; 0: fixed dt
+  double dt;             // step to try next
+  int stages, rejected;  // of the last step
+  int have_F0;           // F0 already holds F(T) (from the previous step)
+  double **F0, **F1, **Ya, **Yb;
+  double b[RKC_MAX_STAGES+1];
+} rkc_solver;
+
+void rkc_init(rkc_solver *rk, int nx, int ny, double dx, double dy, double kdiff, double dt, double tol)
+{
+  rk->nx = nx;  rk->ny = ny;
+  rk->kx = kdiff/(dx*dx);  rk->ky = kdiff/(dy*dy);
+  rk->rho = 4.0*(rk->kx + rk->ky);
+  rk->tol = tol;  rk->dt = dt;
+  rk->have_F0 = 0;
+  rk->F0 = alloc_2d(nx, ny);  rk->F1 = alloc_2d(nx, ny);
+  rk->Ya = alloc_2d(nx, ny);  rk->Yb = alloc_2d(nx, ny);
+}
+
+void rkc_free(rkc_solver *rk)
+{
+  free_2d(rk->F0);  free_2d(rk->F1);
+  free_2d(rk->Ya);  free_2d(rk->Yb);
+}
+
+// F = kdiff lap(Y) off the boundary (F stays 0 on it)
+void rkc_rhs(rkc_solver *rk, double **Y, double **F)
 {
-  double norm_diff = 0.0, local_diff;
   int i, j;
 
-  for(i=0; i<nx; i++)
-   for(j=0; j<ny; j++)
-   {
-     local_diff = arr1[i][j] - arr2[i][j];
-     norm_diff += local_diff * local_diff;
-   }
-   norm_diff = sqrt(norm_diff/(double) (nx*ny));
-   return norm_diff;
+  for(i=1; i<rk->nx-1; i++)
+  {
+    const double *restrict t  = Y[i];
+    const double *restrict tl = Y[i-1];
+    const double *restrict tr = Y[i+1];
+    double *restrict f = F[i];
+
+    for(j=1; j<rk->ny-1; j++)
+      f[j] = rk->kx*(tr[j] + tl[j] - 2.0*t[j]) + rk->ky*(t[j+1] + t[j-1] - 2.0*t[j]);
+  }
+}
+
+// b_j = T_j''(w0)/T_j'(w0)^2 from the Chebyshev recurrences; returns w1
+double rkc_coeffs(int s, double w0, double *b)
+{
+  int j;
+  double t0 = 1.0, t1 = w0, d0 = 0.0, d1 = 1.0, e0 = 0.0, e1 = 0.0, t2, d2, e2;
+
+  for(j=2; j<=s; j++)
+  {
+    t2 = 2.0*w0*t1 - t0;
+    d2 = 2.0*t1 + 2.0*w0*d1 - d0;
+    e2 = 4.0*d1 + 2.0*w0*e1 - e0;
+    b[j] = e2/(d2*d2);
+    t0 = t1;  t1 = t2;  d0 = d1;  d1 = d2;  e0 = e1;  e1 = e2;
+  }
+  b[0] = b[1] = b[2];
+  return d1/e1;
+}
+
+// One RKC step of length dt from T into Tnew; returns the weighted rms of
+// the local error estimate (0 with a fixed dt)
+double rkc_step(rkc_solver *rk, double dt, double **T, double **Tnew)
+{
+  int i, j, k, s, nx = rk->nx, ny = rk->ny;
+  double w0, w1, mu, nu, mut, gt, c0, Tj, Tjm1, Tjm2, est, wt, err = 0.0;
+  double **Y1, **Y2, **dst;
+
+  s = 1 + (int)sqrt(1.0 + 1.54*dt*rk->rho);
+  if(s < 2) s = 2;
+  if(s > RKC_MAX_STAGES) s = RKC_MAX_STAGES;
+  rk->stages = s;
+  w0 = 1.0 + 2.0/(13.0*s*s);
+  w1 = rkc_coeffs(s, w0, rk->b);
+
+  if(!rk->have_F0)
+    rkc_rhs(rk, T, rk->F0);
+
+  // stage 1
+  mut = rk->b[1]*w1;
+  for(i=1; i<nx-1; i++)
+    for(j=1; j<ny-1; j++)
+      rk->Ya[i][j] = T[i][j] + mut*dt*rk->F0[i][j];
+
+  // stages 2..s, with T_j(w0) for a_j = 1 - b_j T_j(w0)
+  Y2 = T;  Y1 = rk->Ya;
+  Tjm2 = 1.0;  Tjm1 = w0;
+  for(k=2; k<=s; k++)
+  {
+    mu  = 2.0*w0*rk->b[k]/rk->b[k-1];
+    nu  = -rk->b[k]/rk->b[k-2];
+    mut = 2.0*w1*rk->b[k]/rk->b[k-1];
+    gt  = -(1.0 - rk->b[k-1]*Tjm1)*mut;
+    c0  = 1.0 - mu - nu;
+    dst = (k == s) ? Tnew : (k == 2) ? rk->Yb : Y2;
+
+#pragma omp parallel for private(j) schedule(static)
+    for(i=1; i<nx-1; i++)
+    {
+      const double *t  = Y1[i];
+      const double *tl = Y1[i-1];
+      const double *tr = Y1[i+1];
+      const double *y0 = T[i];
+      const double *y2 = Y2[i];
+      const double *f0 = rk->F0[i];
+      double *yn = dst[i];
+
+      for(j=1; j<ny-1; j++)
+        yn[j] = c0*y0[j] + mu*t[j] + nu*y2[j] + mut*dt*(rk->kx*(tr[j] + tl[j] - 2.0*t[j]) + rk->ky*(t[j+1] + t[j-1] - 2.0*t[j])) + gt*dt*f0[j];
+    }
+
+    Tj = 2.0*w0*Tjm1 - Tjm2;
+    Tjm2 = Tjm1;  Tjm1 = Tj;
+    Y2 = Y1;  Y1 = dst;
+  }
+
+  if(rk->tol <= 0.0)
+  {
+    rk->have_F0 = 0;
+    return 0.0;
+  }
+
+  // error estimate (12 (Y_0 - Y_s) + 6 dt (F(Y_0) + F(Y_s)))/15
+  rkc_rhs(rk, Tnew, rk->F1);
+  for(i=1; i<nx-1; i++)
+    for(j=1; j<ny-1; j++)
+    {
+      est = (12.0*(T[i][j] - Tnew[i][j]) + 6.0*dt*(rk->F0[i][j] + rk->F1[i][j]))/15.0;
+      wt = rk->tol*(1.0 + fmax(fabs(T[i][j]), fabs(Tnew[i][j])));
+      err += (est/wt)*(est/wt);
+    }
+  return sqrt(err/((double)(nx-2)*(ny-2)));
+}
+
+// Advances T into Tnew by one accepted step of at most dt_max; returns the
+// step taken. Rejected steps are retried with a smaller dt from the same T.
+double timestep_RKC(rkc_solver *rk, double *x, double *y, double **T, double **Tnew, double dt_max)
+{
+  double dt, err, fac, **Ftmp;
+
+  rk->rejected = 0;
+  for(;;)
+  {
+    // the stage count is capped, and dt with it
+    dt = fmin(fmin(rk->dt, dt_max), ((RKC_MAX_STAGES-1.0)*(RKC_MAX_STAGES-1.0) - 1.0)/(1.54*rk->rho));
+    err = rkc_step(rk, dt, T, Tnew);
+    enforce_bcs(rk->nx, rk->ny, x, y, Tnew);
+    if(rk->tol <= 0.0)
+      return dt;
+
+    fac = (err > 0.0) ? 0.8*pow(err, -1.0/3.0) : 10.0;
+    fac = fmin(10.0, fmax(0.1, fac));
+    if(err <= 1.0)
+    {
+      // F(Y_s) is F(T) of the next step
+      Ftmp = rk->F0;  rk->F0 = rk->F1;  rk->F1 = Ftmp;
+      rk->have_F0 = 1;
+      // a step shortened to land on an output time does not hold back the next one
+      rk->dt = (dt < rk->dt && fac >= 1.0) ? fmax(rk->dt, fac*dt) : fac*dt;
+      return dt;
+    }
+    rk->rejected++;
+    rk->dt = fac*dt;
+  }
+}
+
+// Constant-coefficient tridiagonal system along one grid line of n points
+//   (1+r) u[k] - r/2 (u[k-1] + u[k+1]) = d[k],   k = 1..n-2,  u[0] = u[n-1] = 0
+// The Thomas forward elimination depends only on n and r, so it is done once
+// and reused by every line and every time step.
+typedef struct
+{
+  int n;
+  double r, a;    // a = -r/2 is both off-diagonals
+  double *cp;     // modified super-diagonal
+  double *inv;    // reciprocal of the modified diagonal
+} tridiag_factor;
+
+void tridiag_factor_init(tridiag_factor *f, int n, double r)
+{
+  int k;
+
+  f->n = n;  f->r = r;  f->a = -0.5*r;
+  f->cp = (double *)calloc(n, sizeof(double));
+  f->inv = (double *)calloc(n, sizeof(double));
+
+  for(k=1; k<n-1; k++)
+  {
+    f->inv[k] = 1.0/(1.0 + r - f->a*f->cp[k-1]);
+    f->cp[k] = f->a*f->inv[k];
+  }
+}
+
+void tridiag_factor_free(tridiag_factor *f)
+{
+  free(f->cp);
+  free(f->inv);
+}
+
+// Solve the system of f along the first index of d for all columns jst..jen-1
+// at once: row d[k] holds entry k of every line, so the inner loop runs with
+// unit stride across lines and vectorizes. Rows 0 and n-1 of d must be zero.
+void tridiag_solve_batched(tridiag_factor *f, int jst, int jen, double **d)
+{
+  int j, k;
+  double a = f->a;
+
+  for(k=1; k<f->n-1; k++)
+  {
+    const double *restrict dp = d[k-1];
+    double *restrict dk = d[k];
+    double inv = f->inv[k];
+
+    for(j=jst; j<jen; j++)
+      dk[j] = (dk[j] - a*dp[j])*inv;
+  }
+
+  for(k=f->n-3; k>=1; k--)
+  {
+    const double *restrict dn = d[k+1];
+    double *restrict dk = d[k];
+    double cp = f->cp[k];
+
+    for(j=jst; j<jen; j++)
+      dk[j] -= cp*dn[j];
+  }
+}
+
+// Peaceman-Rachford ADI step, unconditionally stable for any dt:
+//   (I - rx/2 Dxx) T*    = (I + ry/2 Dyy) T^n     (x-lines)
+//   (I - ry/2 Dyy) T^n+1 = (I + rx/2 Dxx) T*      (y-lines)
+// x-lines are solved in place in W (nx x ny); for the y-lines the right-hand
+// side is written transposed into Wt (ny x nx) so that they are batched with
+// unit stride too. The boundary rows and columns of W and Wt stay zero.
+void timestep_ADI(int nx, int ny, tridiag_factor *fx, tridiag_factor *fy, double *x, double *y, double **T, double **W, double **Wt, double **Tnew)
+{
+  int i, j;
+  double rx = fx->r, ry = fy->r;
+
+  for(i=1; i<nx-1; i++)
+  {
+    const double *restrict t = T[i];
+    double *restrict w = W[i];
+
+    for(j=1; j<ny-1; j++)
+      w[j] = (1.0 - ry)*t[j] + 0.5*ry*(t[j+1] + t[j-1]);
+  }
+  tridiag_solve_batched(fx, 1, ny-1, W);
+
+  for(j=1; j<ny-1; j++)
+  {
+    double *restrict wt = Wt[j];
+
+    for(i=1; i<nx-1; i++)
+      wt[i] = (1.0 - rx)*W[i][j] + 0.5*rx*(W[i+1][j] + W[i-1][j]);
+  }
+  tridiag_solve_batched(fy, 1, nx-1, Wt);
+
+  for(i=1; i<nx-1; i++)
+    for(j=1; j<ny-1; j++)
+      Tnew[i][j] = Wt[j][i];
+
+  // set Dirichlet BCs
+  enforce_bcs(nx,ny,x,y,Tnew);
 }
 
 //void linsolve_hc2d_gs_adi(int nx, int ny, double rx, double ry, double **rhs, double **T, double **Tnew)
@@ -107,73 +504,496 @@ void linsolve_hc2d_gs_adi(int nx, int ny, double rx, double ry, double **rhs, do
       }
   }
 }
-//void linsolve_hc2d_gs_rb(int nx, int ny, double rx, double ry, double **rhs, double **T, double **Tnew)
-//{
-//
-//  // write the red-black Gauss-Seidel method here
-//  // It will be very similar to the original Gauss-Seidel, except 
-//  // that the code-snippet labelled `update the solution' will be
-//  // split into two portions
-//}
 
-void linsolve_hc2d_gs(int nx, int ny, double rx, double ry, double **rhs, double **T, double **Tnew)
+// Half of a red-black Gauss-Seidel sweep with over-relaxation omega (omega = 1:
+// plain GS), in place on T: the points of colour c, (i+j)%2 == c. They only
+// depend on points of the other colour, so the half sweep has no loop-carried
+// dependence: rows can go to different threads and the stride-2 j loop
+// vectorizes. Returns the sum of the squared changes, accumulated as the sweep
+// goes, so no copy of the previous iterate is needed to check convergence.
+double gs_rb_half_sweep(int nx, int ny, double rx, double ry, double omega, double **rhs, double **T, int c)
 {
-  int i, j, k, max_iter;
-  double tol, denom, local_diff, norm_diff;
+  int i, j;
+  double denom = 1.0 + 2.0*rx + 2.0*ry, sum = 0.0;
+
+#pragma omp parallel for private(j) reduction(+:sum) schedule(static)
+  for(i=1; i<nx-1; i++)
+  {
+    const double *restrict tl = T[i-1];
+    const double *restrict tr = T[i+1];
+    const double *restrict b  = rhs[i];
+    double *restrict t = T[i];
+
+    for(j=1 + ((i+1+c) & 1); j<ny-1; j+=2)
+    {
+      double d = omega*((b[j] + rx*(tl[j] + tr[j]) + ry*(t[j-1] + t[j+1]))/denom - t[j]);
+
+      t[j] += d;
+      sum += d*d;
+    }
+  }
+  return sum;
+}
+
+// Both colours, c0 first; sweeping the colours in the opposite order
+// afterwards makes a symmetric smoother
+double gs_rb_sweep(int nx, int ny, double rx, double ry, double omega, double **rhs, double **T, int c0)
+{
+  return gs_rb_half_sweep(nx, ny, rx, ry, omega, rhs, T, c0)
+       + gs_rb_half_sweep(nx, ny, rx, ry, omega, rhs, T, c0 ^ 1);
+}
+
+// Lexicographic Gauss-Seidel sweep in place on T; returns the sum of the
+// squared changes
+double gs_sweep(int nx, int ny, double rx, double ry, double **rhs, double **T)
+{
+  int i, j;
+  double denom = 1.0 + 2.0*rx + 2.0*ry, sum = 0.0, t;
+
+  for(i=1; i<nx-1; i++)
+   for(j=1; j<ny-1; j++)
+   {
+     t = (rhs[i][j] + rx*T[i-1][j] + rx*T[i+1][j] + ry*T[i][j-1] + ry*T[i][j+1]) /denom;
+     sum += (t - T[i][j])*(t - T[i][j]);
+     T[i][j] = t;
+   }
+  return sum;
+}
+
+// Jacobi sweep from T into Tnew. With w != 1 it is the Chebyshev
+// semi-iterative step Tnew = Tprev + w (J(T) - Tprev), where Tprev, the
+// iterate before T, is what Tnew holds on entry; each point only needs its
+// own old value, so two buffers are enough. Returns the sum of the squared
+// changes from T to Tnew.
+double jacobi_sweep(int nx, int ny, double rx, double ry, double w, double **rhs, double **T, double **Tnew)
+{
+  int i, j;
+  double denom = 1.0 + 2.0*rx + 2.0*ry, sum = 0.0;
+
+#pragma omp parallel for private(j) reduction(+:sum) schedule(static)
+  for(i=1; i<nx-1; i++)
+  {
+    const double *restrict tl = T[i-1];
+    const double *restrict tr = T[i+1];
+    const double *restrict tc = T[i];
+    const double *restrict b  = rhs[i];
+    double *restrict tn = Tnew[i];
+
+    for(j=1; j<ny-1; j++)
+    {
+      double t = (b[j] + rx*(tl[j] + tr[j]) + ry*(tc[j-1] + tc[j+1]))/denom;
+
+      if(w != 1.0) t = tn[j] + w*(t - tn[j]);
+      sum += (t - tc[j])*(t - tc[j]);
+      tn[j] = t;
+    }
+  }
+  return sum;
+}
+
+// Common driver of the relaxation methods (jacobi, gs, gs_rb). The sweeps
+// return the squared update norm they accumulate on the fly, Jacobi swaps
+// buffer pointers instead of copying the new iterate back, and convergence is
+// only looked at every check_every sweeps. With accel chebyshev, Jacobi
+// becomes the Chebyshev semi-iteration and red-black SOR gets the Chebyshev
+// omega schedule (omega changes every half sweep and tends to the optimal
+// value), both driven by the spectral radius of the Jacobi iteration, which
+// is known exactly for this operator.
+typedef struct
+{
+  int method, nx, ny, check_every, accel;
+  double rx, ry, omega, rho;
+  double **W;            // second buffer for Jacobi
+} relax_solver;
+
+void relax_init(relax_solver *rs, int method, int nx, int ny, double rx, double ry, double omega, int check_every, int accel, double **W)
+{
+  rs->method = method;  rs->nx = nx;  rs->ny = ny;
+  rs->rx = rx;  rs->ry = ry;  rs->omega = omega;
+  rs->check_every = (check_every > 0) ? check_every : 1;
+  rs->accel = accel;
+  rs->W = W;
+  rs->rho = (2.0*rx*cos(M_PI/(nx-1)) + 2.0*ry*cos(M_PI/(ny-1)))/(1.0 + 2.0*rx + 2.0*ry);
+}
+
+// Iterates until the rms update drops below tol; the solution is left in T
+void linsolve_relax(relax_solver *rs, double **rhs, double **T)
+{
+  int i, j, k, max_iter, nx = rs->nx, ny = rs->ny;
+  double tol, norm_diff, sum, w, rho2 = rs->rho*rs->rho;
+  double **src = T, **dst = rs->W, **tmp;
 
   max_iter = 1000; tol = 1.0e-6;
-  denom = 1.0 + 2.0*rx + 2.0*ry;
+  w = (rs->accel == ACCEL_CHEBYSHEV) ? 1.0 : rs->omega;
 
-  for(k=0; k<max_iter;k++)
+  for(k=0; k<max_iter; k++)
   {
     // update the solution
+    if(rs->method == SOLVER_JACOBI)
+    {
+      if(rs->accel == ACCEL_CHEBYSHEV && k > 0)
+        w = (k == 1) ? 1.0/(1.0 - 0.5*rho2) : 1.0/(1.0 - 0.25*rho2*w);
+      sum = jacobi_sweep(nx, ny, rs->rx, rs->ry, (rs->accel == ACCEL_CHEBYSHEV) ? w : 1.0, rhs, src, dst);
+      tmp = src;  src = dst;  dst = tmp;
+    }
+    else if(rs->method == SOLVER_GS)
+      sum = gs_sweep(nx, ny, rs->rx, rs->ry, rhs, T);
+    else
+    {
+      sum = gs_rb_half_sweep(nx, ny, rs->rx, rs->ry, w, rhs, T, 0);
+      if(rs->accel == ACCEL_CHEBYSHEV)
+        w = (k == 0) ? 1.0/(1.0 - 0.5*rho2) : 1.0/(1.0 - 0.25*rho2*w);
+      sum += gs_rb_half_sweep(nx, ny, rs->rx, rs->ry, w, rhs, T, 1);
+      if(rs->accel == ACCEL_CHEBYSHEV)
+        w = 1.0/(1.0 - 0.25*rho2*w);
+    }
+
+    // check for convergence
+    if((k+1) % rs->check_every == 0)
+    {
+      norm_diff = sqrt(sum/(double)(nx*ny));
+      if(norm_diff < tol) break;
+    }
+  }
+
+  // at most one copy per solve, when Jacobi stopped on the other buffer
+  if(src != T)
     for(i=1; i<nx-1; i++)
-     for(j=1; j<ny-1; j++)
-       Tnew[i][j] = (rhs[i][j] + rx*Tnew[i-1][j] + rx*T[i+1][j] + ry*Tnew[i][j-1] + ry*T[i][j+1]) /denom;
+      for(j=1; j<ny-1; j++)
+        T[i][j] = src[i][j];
+  //printf("In linsolve_relax: %d %e\n", k, norm_diff);
+}
+
+// Geometric multigrid for the Backward Euler system
+//   (1 + 2rx + 2ry) u[i][j] - rx (u[i-1][j] + u[i+1][j]) - ry (u[i][j-1] + u[i][j+1]) = f[i][j]
+// with u = 0 on the boundary. Coarse point I sits on fine point 2I; a grid of
+// m interior points has m/2 coarse ones (for even m the last coarse interval
+// next to the boundary is one fine cell wide, which only costs a little
+// convergence rate). The coarse operators are rediscretized: the spacing
+// doubles, so rx and ry drop by 4 per level. Restriction is full weighting,
+// prolongation bilinear, and the coarsest grid (at most 2 interior points in
+// some direction) is just smoothed a number of times.
+#define MG_MAX_LEVELS 20
+#define MG_COARSE_SWEEPS 20
+
+typedef struct
+{
+  int nx, ny;
+  double rx, ry;
+  double **u, **f, **r;   // level 0: u and f are the caller's arrays
+} mg_level;
+
+typedef struct
+{
+  int nlev, cycle, smoother, sweeps;
+  double omega;           // relaxation factor of the smoother
+  mg_level lev[MG_MAX_LEVELS];
+} mg_solver;
+
+void mg_init(mg_solver *mg, int nx, int ny, double rx, double ry, int cycle, int smoother, int sweeps, double omega)
+{
+  int l;
+
+  mg->cycle = cycle;  mg->smoother = smoother;
+  mg->sweeps = sweeps;  mg->omega = omega;
+
+  for(l=0; l<MG_MAX_LEVELS; l++)
+  {
+    mg_level *lv = &mg->lev[l];
+
+    lv->nx = nx;  lv->ny = ny;
+    lv->rx = rx;  lv->ry = ry;
+    lv->u = (l > 0) ? alloc_2d(nx, ny) : NULL;
+    lv->f = (l > 0) ? alloc_2d(nx, ny) : NULL;
+    lv->r = alloc_2d(nx, ny);
+    mg->nlev = l+1;
+
+    if(nx-2 <= 2 || ny-2 <= 2) break;
+    nx = (nx-2)/2 + 2;  ny = (ny-2)/2 + 2;
+    rx *= 0.25;  ry *= 0.25;
+  }
+}
+
+void mg_free(mg_solver *mg)
+{
+  int l;
+
+  for(l=0; l<mg->nlev; l++)
+  {
+    if(l > 0)
+    {
+      free_2d(mg->lev[l].u);
+      free_2d(mg->lev[l].f);
+    }
+    free_2d(mg->lev[l].r);
+  }
+}
+
+// Weighted Jacobi (weight omega) through the r array of the level
+void mg_jacobi_sweep(mg_level *lv, double omega)
+{
+  int i, j, nx = lv->nx, ny = lv->ny;
+  double rx = lv->rx, ry = lv->ry, denom = 1.0 + 2.0*rx + 2.0*ry;
+  double **u = lv->u, **f = lv->f, **t = lv->r;
+
+#pragma omp parallel for private(j) schedule(static)
+  for(i=1; i<nx-1; i++)
+    for(j=1; j<ny-1; j++)
+      t[i][j] = u[i][j] + omega*((f[i][j] + rx*(u[i-1][j] + u[i+1][j]) + ry*(u[i][j-1] + u[i][j+1]))/denom - u[i][j]);
+
+#pragma omp parallel for private(j) schedule(static)
+  for(i=1; i<nx-1; i++)
+    for(j=1; j<ny-1; j++)
+      u[i][j] = t[i][j];
+}
+
+// Red-black sweeps start with colour c0; post-smoothing uses the reverse
+// order of pre-smoothing so that the cycle is symmetric (as a CG preconditioner)
+void mg_smooth(mg_solver *mg, mg_level *lv, int sweeps, int c0)
+{
+  int s;
+
+  for(s=0; s<sweeps; s++)
+  {
+    if(mg->smoother == MG_SMOOTH_JACOBI)
+      mg_jacobi_sweep(lv, mg->omega);
+    else
+      gs_rb_sweep(lv->nx, lv->ny, lv->rx, lv->ry, mg->omega, lv->f, lv->u, c0);
+  }
+}
+
+// r = f - A u; returns the sum of the squared residuals
+double mg_residual(mg_level *lv)
+{
+  int i, j, nx = lv->nx, ny = lv->ny;
+  double rx = lv->rx, ry = lv->ry, denom = 1.0 + 2.0*rx + 2.0*ry, sum = 0.0;
+  double **u = lv->u, **f = lv->f, **r = lv->r;
+
+#pragma omp parallel for private(j) reduction(+:sum) schedule(static)
+  for(i=1; i<nx-1; i++)
+    for(j=1; j<ny-1; j++)
+    {
+      r[i][j] = f[i][j] - denom*u[i][j] + rx*(u[i-1][j] + u[i+1][j]) + ry*(u[i][j-1] + u[i][j+1]);
+      sum += r[i][j]*r[i][j];
+    }
+  return sum;
+}
+
+// Full weighting of the fine residual into the coarse right-hand side; the
+// coarse correction starts from zero
+void mg_restrict(mg_level *fine, mg_level *coarse)
+{
+  int i, j, fi, fj;
+  double **r = fine->r;
+
+#pragma omp parallel for private(j, fi, fj) schedule(static)
+  for(i=1; i<coarse->nx-1; i++)
+    for(j=1; j<coarse->ny-1; j++)
+    {
+      fi = 2*i;  fj = 2*j;
+      coarse->f[i][j] = 0.0625*(4.0*r[fi][fj]
+                               + 2.0*(r[fi-1][fj] + r[fi+1][fj] + r[fi][fj-1] + r[fi][fj+1])
+                               + r[fi-1][fj-1] + r[fi-1][fj+1] + r[fi+1][fj-1] + r[fi+1][fj+1]);
+      coarse->u[i][j] = 0.0;
+    }
+}
+
+// Bilinear interpolation of the coarse correction, added to the fine solution.
+// i>>1 and (i+1)>>1 are the coarse neighbours of fine i (the same point for even i).
+void mg_prolong(mg_level *coarse, mg_level *fine)
+{
+  int i, j, il, ih, jl, jh;
+  double **uc = coarse->u;
+
+#pragma omp parallel for private(j, il, ih, jl, jh) schedule(static)
+  for(i=1; i<fine->nx-1; i++)
+  {
+    il = i >> 1;  ih = (i+1) >> 1;
+    for(j=1; j<fine->ny-1; j++)
+    {
+      jl = j >> 1;  jh = (j+1) >> 1;
+      fine->u[i][j] += 0.25*(uc[il][jl] + uc[ih][jl] + uc[il][jh] + uc[ih][jh]);
+    }
+  }
+}
+
+// V-cycle, or F-cycle (an F-cycle on the coarse grid followed by a V-cycle)
+void mg_cycle(mg_solver *mg, int l, int cycle)
+{
+  mg_level *lv = &mg->lev[l];
+
+  if(l == mg->nlev-1)
+  {
+    mg_smooth(mg, lv, MG_COARSE_SWEEPS, 0);
+    return;
+  }
+
+  mg_smooth(mg, lv, mg->sweeps, 0);
+  mg_residual(lv);
+  mg_restrict(lv, &mg->lev[l+1]);
+  mg_cycle(mg, l+1, cycle);
+  if(cycle == MG_CYCLE_F)
+    mg_cycle(mg, l+1, MG_CYCLE_V);
+  mg_prolong(&mg->lev[l+1], lv);
+  mg_smooth(mg, lv, mg->sweeps, 1);
+}
+
+// Cycles until the rms residual drops below tol, in place on T. The work per
+// cycle is O(nx*ny) and the number of cycles does not grow with the grid.
+void linsolve_hc2d_mg(mg_solver *mg, double **rhs, double **T)
+{
+  int k, max_iter, nx = mg->lev[0].nx, ny = mg->lev[0].ny;
+  double tol, norm_diff;
+
+  max_iter = 100; tol = 1.0e-6;
+  mg->lev[0].u = T;
+  mg->lev[0].f = rhs;
+
+  for(k=0; k<max_iter; k++)
+  {
+    mg_cycle(mg, 0, mg->cycle);
 
     // check for convergence
-    norm_diff = get_error_norm_2d(nx, ny, T, Tnew);
+    norm_diff = sqrt(mg_residual(&mg->lev[0])/(double)(nx*ny));
     if(norm_diff < tol) break;
+  }
+  //printf("In linsolve_hc2d_mg: %d %e\n", k, norm_diff);
+}
 
-    // prepare for next iteration
-    for(i=0; i<nx; i++)
-     for(j=0; j<ny; j++)
-       T[i][j] = Tnew[i][j];
+// Preconditioned conjugate gradients for the (symmetric positive definite)
+// Backward Euler system, matrix-free, in the pipelined form of Ghysels and
+// Vanroose: each iteration needs the three inner products (r,u), (w,u) and
+// (r,r) only once, and they come out of the same pass as the vector updates.
+// In the MPI code they go into one non-blocking reduction that runs while
+// the preconditioner and the operator are applied; the serial code follows
+// the same recurrences. The preconditioner is the diagonal (Jacobi) or one
+// symmetric multigrid V-cycle.
+typedef struct
+{
+  int nx, ny, precond;
+  double rx, ry;
+  double **r, **u, **w, **m, **n, **z, **q, **s, **p;
+  mg_solver *mg;
+} cg_solver;
+
+void cg_init(cg_solver *cg, int nx, int ny, double rx, double ry, int precond, mg_solver *mg)
+{
+  cg->nx = nx;  cg->ny = ny;
+  cg->rx = rx;  cg->ry = ry;
+  cg->precond = precond;  cg->mg = mg;
+  cg->r = alloc_2d(nx, ny);  cg->u = alloc_2d(nx, ny);  cg->w = alloc_2d(nx, ny);
+  cg->m = alloc_2d(nx, ny);  cg->n = alloc_2d(nx, ny);  cg->z = alloc_2d(nx, ny);
+  cg->q = alloc_2d(nx, ny);  cg->s = alloc_2d(nx, ny);  cg->p = alloc_2d(nx, ny);
+}
+
+void cg_free(cg_solver *cg)
+{
+  free_2d(cg->r);  free_2d(cg->u);  free_2d(cg->w);
+  free_2d(cg->m);  free_2d(cg->n);  free_2d(cg->z);
+  free_2d(cg->q);  free_2d(cg->s);  free_2d(cg->p);
+}
+
+// Av = A v on the interior; v and Av are zero on the boundary
+void hc2d_apply(int nx, int ny, double rx, double ry, double **v, double **Av)
+{
+  int i, j;
+  double denom = 1.0 + 2.0*rx + 2.0*ry;
 
+#pragma omp parallel for private(j) schedule(static)
+  for(i=1; i<nx-1; i++)
+  {
+    const double *restrict vl = v[i-1];
+    const double *restrict vr = v[i+1];
+    const double *restrict vc = v[i];
+    double *restrict av = Av[i];
+
+    for(j=1; j<ny-1; j++)
+      av[j] = denom*vc[j] - rx*(vl[j] + vr[j]) - ry*(vc[j-1] + vc[j+1]);
   }
-  printf("In linsolve_hc2d_gs: %d %e\n", k, norm_diff);
 }
 
-void linsolve_hc2d_jacobi(int nx, int ny, double rx, double ry, double **rhs, double **T, double **Tnew)
+void cg_precond_apply(cg_solver *cg, double **v, double **Mv)
 {
-  int i, j, k, max_iter;
-  double tol, denom, local_diff, norm_diff;
+  int i, j, nx = cg->nx, ny = cg->ny;
+  double dinv = 1.0/(1.0 + 2.0*cg->rx + 2.0*cg->ry);
+
+  if(cg->precond == CG_PRECOND_MG)
+  {
+    for(i=0; i<nx; i++)
+      for(j=0; j<ny; j++)
+        Mv[i][j] = 0.0;
+    cg->mg->lev[0].u = Mv;
+    cg->mg->lev[0].f = v;
+    mg_cycle(cg->mg, 0, MG_CYCLE_V);
+    return;
+  }
+
+  if(cg->precond == CG_PRECOND_NONE) dinv = 1.0;
+#pragma omp parallel for private(j) schedule(static)
+  for(i=1; i<nx-1; i++)
+    for(j=1; j<ny-1; j++)
+      Mv[i][j] = dinv*v[i][j];
+}
+
+void linsolve_hc2d_cg(cg_solver *cg, double **rhs, double **T)
+{
+  int i, j, k, max_iter, nx = cg->nx, ny = cg->ny;
+  double tol, norm_diff, dots[3], gamma, delta, gamma_old = 0.0, alpha = 0.0, beta;
+  double **r = cg->r, **u = cg->u, **w = cg->w, **m = cg->m, **n = cg->n;
+  double **z = cg->z, **q = cg->q, **s = cg->s, **p = cg->p;
 
   max_iter = 1000; tol = 1.0e-6;
-  denom = 1.0 + 2.0*rx + 2.0*ry;
 
-  for(k=0; k<max_iter;k++)
-  {
-    // update the solution
-    for(i=1; i<nx-1; i++)
-     for(j=1; j<ny-1; j++)
-       Tnew[i][j] = (rhs[i][j] + rx*T[i-1][j] + rx*T[i+1][j] + ry*T[i][j-1] + ry*T[i][j+1]) /denom;
+  // r = b - A x, u = M^-1 r, w = A u
+  hc2d_apply(nx, ny, cg->rx, cg->ry, T, n);
+  for(i=1; i<nx-1; i++)
+    for(j=1; j<ny-1; j++)
+      r[i][j] = rhs[i][j] - n[i][j];
+  cg_precond_apply(cg, r, u);
+  hc2d_apply(nx, ny, cg->rx, cg->ry, u, w);
 
+  dots[0] = dots[1] = dots[2] = 0.0;
+  for(i=1; i<nx-1; i++)
+    for(j=1; j<ny-1; j++)
+    {
+      dots[0] += r[i][j]*u[i][j];  dots[1] += w[i][j]*u[i][j];  dots[2] += r[i][j]*r[i][j];
+    }
+
+  for(k=0; k<max_iter; k++)
+  {
     // check for convergence
-    norm_diff = get_error_norm_2d(nx, ny, T, Tnew);
+    norm_diff = sqrt(dots[2]/(double)(nx*ny));
     if(norm_diff < tol) break;
 
-    // prepare for next iteration
-    for(i=0; i<nx; i++)
-     for(j=0; j<ny; j++)
-       T[i][j] = Tnew[i][j];
+    // m = M^-1 w, n = A m: the work that hides the reduction in the MPI code
+    cg_precond_apply(cg, w, m);
+    hc2d_apply(nx, ny, cg->rx, cg->ry, m, n);
 
-  }
-  //printf("In linsolve_hc2d_jacobi: %d %e\n", k, norm_diff);
+    gamma = dots[0];  delta = dots[1];
+    beta  = (k > 0) ? gamma/gamma_old : 0.0;
+    alpha = (k > 0) ? gamma/(delta - beta*gamma/alpha) : gamma/delta;
+    gamma_old = gamma;
 
+    // all recurrences and the next inner products in one pass
+    dots[0] = dots[1] = dots[2] = 0.0;
+    for(i=1; i<nx-1; i++)
+      for(j=1; j<ny-1; j++)
+      {
+        z[i][j] = n[i][j] + beta*z[i][j];
+        q[i][j] = m[i][j] + beta*q[i][j];
+        s[i][j] = w[i][j] + beta*s[i][j];
+        p[i][j] = u[i][j] + beta*p[i][j];
+        T[i][j] += alpha*p[i][j];
+        r[i][j] -= alpha*s[i][j];
+        u[i][j] -= alpha*q[i][j];
+        w[i][j] -= alpha*z[i][j];
+        dots[0] += r[i][j]*u[i][j];  dots[1] += w[i][j]*u[i][j];  dots[2] += r[i][j]*r[i][j];
+      }
+  }
+  //printf("In linsolve_hc2d_cg: %d %e\n", k, norm_diff);
 }
 
-void timestep_BwdEuler(int nx, int ny, double dt, double dx, double dy, double kdiff, double *x, double *y, double **T, double **rhs, double **Tnew)
+void timestep_BwdEuler(int nx, int ny, double dt, double dx, double dy, double kdiff, double *x, double *y, double **T, double **rhs, double **Tnew, int solver, relax_solver *rs, mg_solver *mg, cg_solver *cg)
 {
 
   int i,j;
@@ -202,17 +1022,176 @@ void timestep_BwdEuler(int nx, int ny, double dt, double dx, double dy, double k
     rhs[nx-1][j] = 0.0;
   }
 
-  //// -- comment out all except one of the function calls below
-  //linsolve_hc2d_jacobi(nx, ny, rx, ry, rhs, T, Tnew);
-  // linsolve_hc2d_gs(nx, ny, rx, ry, rhs, T, Tnew);
-  linsolve_hc2d_gs_adi(nx, ny, rx, ry, rhs, T, Tnew);
-  //linsolve_hc2d_gs_rb(nx, ny, rx, ry, rhs, T, Tnew);
+  // all solvers start from T and leave the new time level in T
+  if(solver == SOLVER_GS_ADI)
+    linsolve_hc2d_gs_adi(nx, ny, rx, ry, rhs, T, Tnew);
+  else if(solver == SOLVER_MG)
+    linsolve_hc2d_mg(mg, rhs, T);
+  else if(solver == SOLVER_CG)
+    linsolve_hc2d_cg(cg, rhs, T);
+  else
+    linsolve_relax(rs, rhs, T);
 
   // set Dirichlet BCs
   enforce_bcs(nx,ny,x,y,T);
 
 }
 
+// Checkpoints ckpt_<it>.bin in the format of the MPI code: this 128-byte
+// header with magic "HC2DCKPT", then the nx x ny field as native-endian
+// doubles, i-major. Either program can restart from the other's checkpoints.
+// A checkpoint is written under a temporary name and renamed when complete;
+// ckpt_latest names the newest and only the last keep are left on disk.
+#define CKPT_MAX_KEEP 16
+
+typedef struct
+{
+  char   magic[8];          // "HC2DSNAP", or "HC2DCKPT" for a checkpoint
+  int    version;
+  int    header_bytes;      // offset of the field data
+  int    elem_bytes;        // bytes per stored value
+  int    nxglob, nyglob;
+  int    it;
+  int    px, py;            // processor grid that wrote the file (1 x 1 here)
+  double time;
+  double xstglob, xenglob, ystglob, yenglob;
+  double dt_next;           // step the adaptive (RKC) stepper tries next
+  int    scheme;            // the scheme that wrote it
+  int    nzglob;            // planes in z (1 here, 0 in older files)
+  double zstglob, zenglob;
+  int    pz;
+  char   reserved[12];
+} snapshot_header;
+
+typedef struct
+{
+  int keep, n;
+  int its[CKPT_MAX_KEEP];   // steps of the kept checkpoints, oldest first
+} checkpoint_ring;
+
+void write_checkpoint(checkpoint_ring *ring, int nx, int ny, int it, double tcurr, double dt_next, int scheme, double *x, double *y, double **T)
+{
+  snapshot_header hdr;
+  char fname[100], tmpname[108];
+  int k;
+  FILE *fp;
+
+  memset(&hdr, 0, sizeof(snapshot_header));
+  memcpy(hdr.magic, "HC2DCKPT", 8);
+  hdr.version = 1;
+  hdr.header_bytes = sizeof(snapshot_header);
+  hdr.elem_bytes = sizeof(double);
+  hdr.nxglob = nx;  hdr.nyglob = ny;
+  hdr.it = it;
+  hdr.px = hdr.py = hdr.pz = 1;
+  hdr.nzglob = 1;
+  hdr.time = tcurr;
+  hdr.xstglob = x[0];  hdr.xenglob = x[nx-1];
+  hdr.ystglob = y[0];  hdr.yenglob = y[ny-1];
+  hdr.dt_next = dt_next;
+  hdr.scheme = scheme;
+
+  sprintf(fname, "ckpt_%06d.bin", it);
+  sprintf(tmpname, "%s.tmp", fname);
+  fp = fopen(tmpname, "wb");
+  fwrite(&hdr, sizeof(snapshot_header), 1, fp);
+  fwrite(T[0], sizeof(double), (size_t)nx*ny, fp);   // rows are contiguous
+  fclose(fp);
+  rename(tmpname, fname);
+
+  fp = fopen("ckpt_latest.tmp", "w");
+  fprintf(fp, "%s\n", fname);
+  fclose(fp);
+  rename("ckpt_latest.tmp", "ckpt_latest");
+
+  if(ring->n == ring->keep)
+  {
+    sprintf(fname, "ckpt_%06d.bin", ring->its[0]);
+    remove(fname);
+    for(k = 1; k < ring->n; k++)
+      ring->its[k-1] = ring->its[k];
+    ring->n--;
+  }
+  ring->its[ring->n++] = it;
+  printf("Wrote checkpoint ckpt_%06d.bin at time step = %d, time = %lf\n", it, it, tcurr);
+}
+
+int cmp_int(const void *a, const void *b)
+{
+  return (*(const int *)a > *(const int *)b) - (*(const int *)a < *(const int *)b);
+}
+
+// After a restart from step it, takes over the checkpoints the earlier run
+// left in the directory (ckpt_<step>.bin up to step it), so that they rotate
+// out like new ones; any beyond the last keep are removed right away
+void restore_checkpoint_ring(checkpoint_ring *ring, int it)
+{
+  DIR *dp;
+  struct dirent *e;
+  char fname[100];
+  int n = 0, cap = 64, k, step, len;
+  int *its;
+
+  ring->n = 0;
+  if((dp = opendir(".")) == NULL) return;
+  its = (int *)malloc(cap*sizeof(int));
+  while((e = readdir(dp)) != NULL)
+  {
+    len = 0;
+    if(sscanf(e->d_name, "ckpt_%6d.bin%n", &step, &len) != 1 || len != 15 || e->d_name[len] != '\0' || step > it)
+      continue;
+    if(n == cap)
+    {
+      cap *= 2;
+      its = (int *)realloc(its, cap*sizeof(int));
+    }
+    its[n++] = step;
+  }
+  closedir(dp);
+  qsort(its, n, sizeof(int), cmp_int);
+  for(k = 0; k < n; k++)
+  {
+    if(k < n - ring->keep)
+    {
+      sprintf(fname, "ckpt_%06d.bin", its[k]);
+      remove(fname);
+    }
+    else
+      ring->its[ring->n++] = its[k];
+  }
+  free(its);
+}
+
+// Loads a checkpoint (or the one ckpt_latest names, for "latest") into T;
+// returns 0 on success
+int read_checkpoint(const char *name, int nx, int ny, double **T, snapshot_header *hdr)
+{
+  char fname[256];
+  FILE *fp;
+  int ok;
+
+  strncpy(fname, name, sizeof(fname)-1);
+  fname[sizeof(fname)-1] = '\0';
+  if(strcmp(name, "latest") == 0)
+  {
+    fp = fopen("ckpt_latest", "r");
+    ok = (fp != NULL && fscanf(fp, "%255s", fname) == 1);
+    if(fp != NULL) fclose(fp);
+    if(!ok) return 1;
+  }
+
+  fp = fopen(fname, "rb");
+  if(fp == NULL) return 1;
+  ok = (fread(hdr, sizeof(snapshot_header), 1, fp) == 1) && memcmp(hdr->magic, "HC2DCKPT", 8) == 0 &&
+       hdr->elem_bytes == sizeof(double) && hdr->nxglob == nx && hdr->nyglob == ny && hdr->nzglob <= 1;
+  ok = ok && fseek(fp, hdr->header_bytes, SEEK_SET) == 0 && fread(T[0], sizeof(double), (size_t)nx*ny, fp) == (size_t)nx*ny;
+  fclose(fp);
+  if(!ok) return 1;
+
+  printf("Restarting from %s (written on a %d x %d grid): time step = %d, time = %lf\n", fname, hdr->px, hdr->py, hdr->it, hdr->time);
+  return 0;
+}
+
 void output_soln(int nx, int ny, int it, double tcurr, double *x, double *y, double **T)
 {
   int i,j;
@@ -223,6 +1202,8 @@ void output_soln(int nx, int ny, int it, double tcurr, double *x, double *y, dou
   //printf("\n%s\n", fname);
 
   fp = fopen(fname, "w");
+  fprintf(fp, "# it %d time %.17g grid %d %d 1 block %d %d 1 start 0 0 0 procs 1 1 1 domain %.17g %.17g %.17g %.17g 0 0\n",
+          it, tcurr, nx, ny, nx, ny, x[0], x[nx-1], y[0], y[ny-1]);
   for(i=0; i<nx; i++)
    for(j=0; j<ny; j++)
       fprintf(fp, "%lf %lf %lf\n", x[i], y[j], T[i][j]);
@@ -240,8 +1221,18 @@ int main()
 {
     int nx, ny;
     double *x, *y, **T, **rhs, tst, ten, xst, xen, yst, yen, dx, dy, dt, tcurr, kdiff;
-    double min_dx_dy, **Tnew;
-    int i, it, num_time_steps, it_print, j;
+    double min_dx_dy, **Tnew, **Ttmp, **Wt = NULL, dt_explicit;
+    run_options opts;
+    tridiag_factor fx, fy;
+    relax_solver rs;
+    mg_solver mg;
+    cg_solver cg;
+    rkc_solver rk;
+    checkpoint_ring ring;
+    snapshot_header ckpt;
+    double t_out;
+    int it0 = 0;
+    int i, it, num_time_steps, it_print, j, use_mg, out_now, total_stages = 0;
     FILE* fp;
     clock_t start_time, end_time;
     double total_time, step_time;
@@ -252,6 +1243,7 @@ int main()
     fscanf(fp, "%lf %lf %lf %lf\n", &xst, &xen, &yst, &yen);
     fscanf(fp, "%lf %lf\n", &tst, &ten);
     fscanf(fp, "%lf\n", &kdiff);
+    read_options(fp, &opts);
     fclose(fp);
 
     printf("Inputs are: %d %lf %lf %lf %lf %lf\n", nx, xst, xen, tst, ten, kdiff);
@@ -259,15 +1251,9 @@ int main()
 
     x = (double *)malloc(nx * sizeof(double));
     y = (double *)malloc(ny * sizeof(double));
-    T = (double **)malloc(nx * sizeof(double *));
-    for(i = 0; i < nx; i++)
-        T[i] = (double *)malloc(ny * sizeof(double));
-    rhs = (double **)malloc(nx * sizeof(double *));
-    for(i = 0; i < nx; i++)
-        rhs[i] = (double *)malloc(ny * sizeof(double));
-    Tnew = (double **)malloc(nx * sizeof(double *));
-    for(i = 0; i < nx; i++)
-        Tnew[i] = (double *)malloc(ny * sizeof(double));
+    T = alloc_2d(nx, ny);
+    rhs = alloc_2d(nx, ny);
+    Tnew = alloc_2d(nx, ny);
 
     grid(nx, xst, xen, x, &dx);  // Initialize the grid in x
     grid(ny, yst, yen, y, &dy);  // Initialize the grid in y
@@ -276,35 +1262,108 @@ int main()
 
     // Prepare for time loop
     min_dx_dy = fmin(dx, dy);
-    dt = 0.25 / kdiff * (min_dx_dy * min_dx_dy);  // Ensure stability
+    dt_explicit = 0.25 / kdiff * (min_dx_dy * min_dx_dy);  // Forward Euler stability limit
+    dt = (opts.dt > 0.0) ? opts.dt : dt_explicit;
+    if(opts.scheme == SCHEME_FWD_EULER && dt > dt_explicit)
+      printf("Warning: dt = %e exceeds the explicit limit %e\n", dt, dt_explicit);
     num_time_steps = (int)((ten - tst) / dt) + 1;
     it_print = num_time_steps / 5;
+    if(it_print < 1) it_print = 1;
+
+    if(opts.scheme == SCHEME_ADI)
+    {
+      tridiag_factor_init(&fx, nx, kdiff*dt/(dx*dx));
+      tridiag_factor_init(&fy, ny, kdiff*dt/(dy*dy));
+      Wt = alloc_2d(ny, nx);
+    }
+    if(opts.scheme == SCHEME_BWD_EULER)
+      relax_init(&rs, opts.solver, nx, ny, kdiff*dt/(dx*dx), kdiff*dt/(dy*dy), opts.omega, opts.check_every, opts.accel, Tnew);
+    use_mg = (opts.scheme == SCHEME_BWD_EULER) &&
+             (opts.solver == SOLVER_MG || (opts.solver == SOLVER_CG && opts.cg_precond == CG_PRECOND_MG));
+    if(use_mg)
+      mg_init(&mg, nx, ny, kdiff*dt/(dx*dx), kdiff*dt/(dy*dy), opts.mg_cycle, opts.mg_smoother, opts.mg_sweeps, opts.omega);
+    if(opts.scheme == SCHEME_BWD_EULER && opts.solver == SOLVER_CG)
+      cg_init(&cg, nx, ny, kdiff*dt/(dx*dx), kdiff*dt/(dy*dy), opts.cg_precond, &mg);
+    t_out = ten;   // the next output time, used by RKC only
+    if(opts.scheme == SCHEME_RKC)
+    {
+      // steps are taken until ten, landing on five evenly spaced output times
+      rkc_init(&rk, nx, ny, dx, dy, kdiff, dt, opts.sts_tol);
+      num_time_steps = INT_MAX;
+      t_out = tst + (ten - tst)/5.0;
+    }
+    printf("Scheme %s, dt = %e, %d time steps\n", opts.scheme == SCHEME_ADI ? "adi" :
+           opts.scheme == SCHEME_BWD_EULER ? "bwd_euler" : opts.scheme == SCHEME_RKC ? "rkc" : "fwd_euler",
+           dt, opts.scheme == SCHEME_RKC ? 0 : num_time_steps);
 
     start_time = clock();  // Start total time measurement
 
+    ring.keep = (opts.checkpoint_keep < 1) ? 1 : (opts.checkpoint_keep > CKPT_MAX_KEEP) ? CKPT_MAX_KEEP : opts.checkpoint_keep;
+    ring.n = 0;
+    tcurr = tst;
+    if(opts.restart[0] != '\0')
+    {
+      // continue after the checkpointed step
+      if(read_checkpoint(opts.restart, nx, ny, T, &ckpt))
+      {
+        printf("Cannot restart from %s: missing file, or not a checkpoint of a %d x %d grid. Stopping now\n", opts.restart, nx, ny);
+        exit(1);
+      }
+      it0 = ckpt.it + 1;
+      tcurr = ckpt.time;
+      restore_checkpoint_ring(&ring, ckpt.it);
+      if(opts.scheme == SCHEME_RKC)
+      {
+        if(ckpt.scheme == SCHEME_RKC) rk.dt = ckpt.dt_next;
+        while(t_out - tcurr <= 1.0e-12*(ten - tst) && t_out < ten)
+          t_out = fmin(t_out + (ten - tst)/5.0, ten);
+      }
+    }
+
     // Start time stepping loop
-    for(it = 0; it < num_time_steps; it++)
+    for(it = it0; it < num_time_steps; it++)
     {
-        tcurr = tst + (double)(it + 1) * dt;
+        if(opts.scheme != SCHEME_RKC)
+          tcurr = tst + (double)(it + 1) * dt;
 
         clock_t step_start = clock();  // Start step time measurement
 
-        // Forward (explicit) Euler
-        timestep_FwdEuler(nx, ny, dt, dx, dy, kdiff, x, y, T, rhs);
+        if(opts.scheme == SCHEME_BWD_EULER)
+        {
+          // updates T in place
+          timestep_BwdEuler(nx, ny, dt, dx, dy, kdiff, x, y, T, rhs, Tnew, opts.solver, &rs, &mg, &cg);
+        }
+        else
+        {
+          if(opts.scheme == SCHEME_ADI)
+            timestep_ADI(nx, ny, &fx, &fy, x, y, T, rhs, Wt, Tnew);
+          else if(opts.scheme == SCHEME_RKC)
+          {
+            tcurr += timestep_RKC(&rk, x, y, T, Tnew, t_out - tcurr);
+            total_stages += rk.stages;
+          }
+          else  // Forward (explicit) Euler
+            timestep_FwdEuler(nx, ny, dt, dx, dy, kdiff, x, y, T, Tnew);
+          Ttmp = T;  T = Tnew;  Tnew = Ttmp;
+        }
 
         clock_t step_end = clock();  // End step time measurement
         step_time = ((double)(step_end - step_start)) / CLOCKS_PER_SEC;
 
-        if(it % it_print == 0)
+        out_now = (opts.scheme == SCHEME_RKC) ? (t_out - tcurr <= 1.0e-12*(ten - tst)) : (it % it_print == 0);
+
+        if(out_now)
             printf("Time step %d: Step time = %f seconds\n", it, step_time);
+        if(out_now && opts.scheme == SCHEME_RKC)
+            printf("RKC: t = %e, %d stages, next dt = %e, %d rejected\n", tcurr, rk.stages, rk.dt, rk.rejected);
 
         // Output solution every it_print time steps
-        if (it == 9) {
+        if (it == opts.text_dump) {
             char filename[100];
-            sprintf(filename, "serial_solution_t10.txt");
+            sprintf(filename, "serial_solution_t%d.txt", it+1);
             FILE *fp = fopen(filename, "w");
-            for (int i = 0; i < nx; i++) {
-                for (int j = 0; j < ny; j++) {
+            for (i = 0; i < nx; i++) {
+                for (j = 0; j < ny; j++) {
                     fprintf(fp, "%0.15lf ", T[i][j]);
                 }
                 fprintf(fp, "\n");
@@ -312,8 +1371,16 @@ int main()
             fclose(fp);
         }
 
-        if(it % it_print == 0)
+        if(out_now)
             output_soln(nx, ny, it, tcurr, x, y, T);
+        if(opts.checkpoint_every > 0 && (it + 1) % opts.checkpoint_every == 0)
+            write_checkpoint(&ring, nx, ny, it, tcurr, (opts.scheme == SCHEME_RKC) ? rk.dt : dt, opts.scheme, x, y, T);
+
+        if(opts.scheme == SCHEME_RKC && out_now)
+        {
+          if(ten - tcurr <= 1.0e-12*(ten - tst)) { it++; break; }
+          t_out = fmin(t_out + (ten - tst)/5.0, ten);
+        }
     }
     
     // Output solution at the last time step
@@ -323,18 +1390,27 @@ int main()
     total_time = ((double)(end_time - start_time)) / CLOCKS_PER_SEC;
 
     printf("Total simulation time: %f seconds\n", total_time);
-    printf("Average step time: %f seconds\n", total_time / num_time_steps);
+    printf("Average step time: %f seconds\n", total_time / ((opts.scheme == SCHEME_RKC ? it : num_time_steps) - it0));
+    if(opts.scheme == SCHEME_RKC)
+      printf("RKC: %d steps, %d stages in all (Forward Euler at the explicit limit: %d steps)\n",
+             it, total_stages, (int)((ten - tst)/dt_explicit) + 1);
 
     // Free allocated memory
-    for(i = 0; i < nx; i++)
-        free(T[i]);
-    free(T);
-    for(i = 0; i < nx; i++)
-        free(rhs[i]);
-    free(rhs);
-    for(i = 0; i < nx; i++)
-        free(Tnew[i]);
-    free(Tnew);
+    if(opts.scheme == SCHEME_ADI)
+    {
+      tridiag_factor_free(&fx);
+      tridiag_factor_free(&fy);
+      free_2d(Wt);
+    }
+    if(use_mg)
+      mg_free(&mg);
+    if(opts.scheme == SCHEME_BWD_EULER && opts.solver == SOLVER_CG)
+      cg_free(&cg);
+    if(opts.scheme == SCHEME_RKC)
+      rkc_free(&rk);
+    free_2d(T);
+    free_2d(rhs);
+    free_2d(Tnew);
     free(y);
     free(x);
 
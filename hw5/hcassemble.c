@@ -0,0 +1,426 @@
+// hcassemble: rebuilds global fields from the per-rank ASCII output of
+// parhc2d_skel (T_x_y_<it>_<rank>_2*4.dat, or T_x_y_z_<it>_<rank>.dat from
+// the 3D build) and of hc2d (T_x_y_<it>.dat), and writes each step as
+// T_<it>.bin in the format of the binary snapshots: a 128-byte header, then
+// the global field as (nzglob, nxglob, nyglob) doubles, j fastest, so that
+//   np.memmap('T_000510.bin', dtype='<f8', mode='r', offset=128, shape=(nzglob, nxglob, nyglob))
+// loads it without parsing. Where a block goes comes from the comment line
+// the solvers write at the top of each file; files of older runs, without
+// it, are placed by their x, y (and z) columns. The files of a step are read
+// and parsed in parallel with OpenMP.
+//
+//   gcc -O2 -fopenmp -o hcassemble hcassemble.c   (without -fopenmp the files are read one by one)
+//   ./hcassemble [-d dir] [-o outdir] all | <it> ...
+//
+// If one step was written by several runs (different suffixes after the
+// rank, e.g. _2*4 and _4*4), each is assembled to T_<it>_<suffix>.bin.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <dirent.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Same layout as in parhc2d_skel.c
+typedef struct
+{
+  char   magic[8];
+  int    version;
+  int    header_bytes;
+  int    elem_bytes;
+  int    nxglob, nyglob;
+  int    it;
+  int    px, py;
+  double time;
+  double xstglob, xenglob, ystglob, yenglob;
+  double dt_next;
+  int    scheme;
+  int    nzglob;
+  double zstglob, zenglob;
+  int    pz;
+  char   reserved[12];
+} snapshot_header;
+
+// Wall-clock seconds, also without OpenMP
+double wall_time()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + 1.0e-9*ts.tv_nsec;
+}
+
+// One rank file, and what it holds once parsed
+typedef struct
+{
+  char path[512];
+  int it, rank;
+  char tag[64];             // what follows the rank in the name ("" for hc2d and 3D output)
+  int has_meta;             // the solver's comment line was found
+  int grid[3], block[3], start[3], procs[3];
+  double time, domain[6];
+  int ncols;                // 3 (x y T) or 4 (x y z T)
+  long nrows;
+  double *vals;             // nrows x ncols, with room for 4 columns
+  int ok;
+} rank_file;
+
+// Parses a file name; returns 1 for an ASCII solution file
+int parse_name(const char *name, rank_file *f)
+{
+  int n = 0, len = strlen(name);
+
+  if(len < 5 || strcmp(name + len - 4, ".dat") != 0) return 0;
+  f->tag[0] = '\0';
+  f->rank = 0;
+  if(sscanf(name, "T_x_y_z_%6d_%4d%n", &f->it, &f->rank, &n) == 2 && n == len - 4)
+    return 1;
+  if(sscanf(name, "T_x_y_%6d_%4d%n", &f->it, &f->rank, &n) == 2 && n > 0)
+  {
+    if(len - 4 - n >= (int)sizeof(f->tag)) return 0;
+    memcpy(f->tag, name + n, len - 4 - n);
+    f->tag[len - 4 - n] = '\0';
+    return 1;
+  }
+  n = 0;
+  if(sscanf(name, "T_x_y_%6d%n", &f->it, &n) == 1 && n == len - 4)
+    return 1;
+  return 0;
+}
+
+void read_rank_file(rank_file *f)
+{
+  FILE *fp;
+  long size, cap = 0, k;
+  char *buf, *p, *q, *end;
+  double v;
+  int c;
+
+  f->ok = 0;
+  f->has_meta = 0;
+  f->nrows = 0;
+  f->ncols = 0;
+  f->vals = NULL;
+  fp = fopen(f->path, "rb");
+  if(fp == NULL) return;
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  buf = (char *)malloc(size + 1);
+  if(fread(buf, 1, size, fp) != (size_t)size)
+  {
+    fclose(fp);
+    free(buf);
+    return;
+  }
+  fclose(fp);
+  buf[size] = '\0';
+  end = buf + size;
+
+  p = buf;
+  while(p < end)
+  {
+    q = strchr(p, '\n');
+    if(q == NULL) q = end;
+    *q = '\0';
+    if(*p == '#')
+    {
+      if(sscanf(p, "# it %*d time %lf grid %d %d %d block %d %d %d start %d %d %d procs %d %d %d domain %lf %lf %lf %lf %lf %lf",
+                &f->time, &f->grid[0], &f->grid[1], &f->grid[2], &f->block[0], &f->block[1], &f->block[2],
+                &f->start[0], &f->start[1], &f->start[2], &f->procs[0], &f->procs[1], &f->procs[2],
+                &f->domain[0], &f->domain[1], &f->domain[2], &f->domain[3], &f->domain[4], &f->domain[5]) == 19)
+      {
+        f->has_meta = 1;
+        cap = (long)f->block[0]*f->block[1]*f->block[2];
+        f->vals = (double *)realloc(f->vals, cap*4*sizeof(double));
+      }
+    }
+    else
+    {
+      // the first data line fixes the number of columns
+      if(f->ncols == 0)
+      {
+        char *r = p, *s;
+        for(;;)
+        {
+          strtod(r, &s);
+          if(s == r) break;
+          f->ncols++;
+          r = s;
+        }
+        if(f->ncols < 3 || f->ncols > 4) f->ncols = 0;
+      }
+      if(f->ncols > 0)
+      {
+        if(f->nrows == cap)
+        {
+          cap = (cap > 0) ? 2*cap : 1024;
+          f->vals = (double *)realloc(f->vals, cap*4*sizeof(double));
+        }
+        for(c = 0, k = f->nrows*f->ncols; c < f->ncols; c++)
+        {
+          v = strtod(p, &p);
+          f->vals[k + c] = v;
+        }
+        f->nrows++;
+      }
+    }
+    p = q + 1;
+  }
+  free(buf);
+  f->ok = (f->nrows > 0);
+}
+
+int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Sorted distinct values of column c over all files
+double *distinct_column(rank_file *files, int nfiles, int c, int *n)
+{
+  long total = 0, k, m = 0;
+  int f;
+  double *v;
+
+  for(f = 0; f < nfiles; f++)
+    total += files[f].nrows;
+  v = (double *)malloc(total*sizeof(double));
+  for(f = 0; f < nfiles; f++)
+    for(k = 0; k < files[f].nrows; k++)
+      v[m++] = files[f].vals[k*files[f].ncols + c];
+  qsort(v, total, sizeof(double), cmp_double);
+  for(k = 0, m = 0; k < total; k++)
+    if(m == 0 || v[k] != v[m-1])
+      v[m++] = v[k];
+  *n = (int)m;
+  return v;
+}
+
+int find_index(double *v, int n, double x)
+{
+  double *p = (double *)bsearch(&x, v, n, sizeof(double), cmp_double);
+  return (p == NULL) ? -1 : (int)(p - v);
+}
+
+// Places the files of one step into a global array and writes it; returns 0 on success
+int assemble(rank_file *files, int nfiles, const char *outname)
+{
+  snapshot_header hdr;
+  int f, d, meta = 1, ncols = files[0].ncols, n[3] = {1, 1, 1}, bad = 0;
+  double *coords[3] = {NULL, NULL, NULL}, *T, t0 = wall_time();
+  long total = 0, size;
+  FILE *fp;
+
+  for(f = 0; f < nfiles; f++)
+  {
+    meta = meta && files[f].has_meta;
+    total += files[f].nrows;
+    if(files[f].ncols != ncols)
+    {
+      fprintf(stderr, "%s: %d columns, expected %d\n", files[f].path, files[f].ncols, ncols);
+      return 1;
+    }
+  }
+
+  memset(&hdr, 0, sizeof(snapshot_header));
+  if(meta)
+  {
+    for(d = 0; d < 3; d++)
+      n[d] = files[0].grid[d];
+    hdr.time = files[0].time;
+    hdr.px = files[0].procs[0];  hdr.py = files[0].procs[1];  hdr.pz = files[0].procs[2];
+    hdr.xstglob = files[0].domain[0];  hdr.xenglob = files[0].domain[1];
+    hdr.ystglob = files[0].domain[2];  hdr.yenglob = files[0].domain[3];
+    hdr.zstglob = files[0].domain[4];  hdr.zenglob = files[0].domain[5];
+  }
+  else
+  {
+    // without the comment line, the grid is the set of coordinates that occur
+    for(d = 0; d < ncols - 1; d++)
+      coords[d] = distinct_column(files, nfiles, d, &n[d]);
+    hdr.xstglob = coords[0][0];  hdr.xenglob = coords[0][n[0]-1];
+    hdr.ystglob = coords[1][0];  hdr.yenglob = coords[1][n[1]-1];
+    if(ncols == 4)
+    {
+      hdr.zstglob = coords[2][0];  hdr.zenglob = coords[2][n[2]-1];
+    }
+    hdr.px = nfiles;  hdr.py = hdr.pz = 1;
+  }
+  size = (long)n[0]*n[1]*n[2];
+  if(total != size)
+  {
+    fprintf(stderr, "%s: the files hold %ld points, the grid %d x %d x %d has %ld\n", outname, total, n[0], n[1], n[2], size);
+    for(d = 0; d < 3; d++) free(coords[d]);
+    return 1;
+  }
+
+  T = (double *)malloc(size*sizeof(double));
+#pragma omp parallel for schedule(dynamic) reduction(|:bad)
+  for(f = 0; f < nfiles; f++)
+  {
+    rank_file *r = &files[f];
+    long k, g;
+    int i, j, l, idx[3];
+
+    for(k = 0; k < r->nrows; k++)
+    {
+      if(meta)
+      {
+        // rows run over planes, then i, then j
+        j = k%r->block[1];
+        i = (k/r->block[1])%r->block[0];
+        l = k/((long)r->block[0]*r->block[1]);
+        idx[0] = r->start[0] + i;  idx[1] = r->start[1] + j;  idx[2] = r->start[2] + l;
+      }
+      else
+      {
+        idx[2] = 0;
+        for(i = 0; i < ncols - 1; i++)
+          idx[i] = find_index(coords[i], n[i], r->vals[k*ncols + i]);
+      }
+      if(idx[0] < 0 || idx[0] >= n[0] || idx[1] < 0 || idx[1] >= n[1] || idx[2] < 0 || idx[2] >= n[2])
+      {
+        bad = 1;
+        continue;
+      }
+      g = ((long)idx[2]*n[0] + idx[0])*n[1] + idx[1];
+      T[g] = r->vals[k*ncols + ncols - 1];
+    }
+  }
+  for(d = 0; d < 3; d++) free(coords[d]);
+  if(bad)
+  {
+    fprintf(stderr, "%s: a block does not fit the global grid\n", outname);
+    free(T);
+    return 1;
+  }
+
+  memcpy(hdr.magic, "HC2DSNAP", 8);
+  hdr.version = 1;
+  hdr.header_bytes = sizeof(snapshot_header);
+  hdr.elem_bytes = sizeof(double);
+  hdr.nxglob = n[0];  hdr.nyglob = n[1];  hdr.nzglob = n[2];
+  hdr.it = files[0].it;
+  fp = fopen(outname, "wb");
+  if(fp == NULL)
+  {
+    fprintf(stderr, "Cannot write %s\n", outname);
+    free(T);
+    return 1;
+  }
+  fwrite(&hdr, sizeof(snapshot_header), 1, fp);
+  fwrite(T, sizeof(double), size, fp);
+  fclose(fp);
+  free(T);
+  printf("Wrote %s: %d x %d x %d from %d file(s)%s, %.3f s\n", outname, n[0], n[1], n[2], nfiles,
+         meta ? "" : " placed by their coordinates", wall_time() - t0);
+  return 0;
+}
+
+int cmp_file(const void *a, const void *b)
+{
+  const rank_file *x = (const rank_file *)a, *y = (const rank_file *)b;
+  int c;
+
+  if(x->it != y->it) return (x->it > y->it) - (x->it < y->it);
+  if((c = strcmp(x->tag, y->tag)) != 0) return c;
+  return (x->rank > y->rank) - (x->rank < y->rank);
+}
+
+int main(int argc, char **argv)
+{
+  const char *dir = ".", *outdir = ".";
+  int a, all = 0, nits = 0, *its, nfiles = 0, cap = 64, f, g, h, k, wanted, ntags, status = 0;
+  rank_file *files = (rank_file *)malloc(cap*sizeof(rank_file)), tmp;
+  char outname[1024], suffix[64];
+  struct dirent *e;
+  DIR *dp;
+  double t0 = wall_time();
+
+  its = (int *)malloc(argc*sizeof(int));
+  for(a = 1; a < argc; a++)
+  {
+    if(strcmp(argv[a], "-d") == 0 && a+1 < argc)
+      dir = argv[++a];
+    else if(strcmp(argv[a], "-o") == 0 && a+1 < argc)
+      outdir = argv[++a];
+    else if(strcmp(argv[a], "all") == 0)
+      all = 1;
+    else
+      its[nits++] = atoi(argv[a]);
+  }
+  if(!all && nits == 0)
+  {
+    fprintf(stderr, "usage: %s [-d dir] [-o outdir] all | <it> ...\n", argv[0]);
+    return 1;
+  }
+
+  dp = opendir(dir);
+  if(dp == NULL)
+  {
+    fprintf(stderr, "Cannot open %s\n", dir);
+    return 1;
+  }
+  while((e = readdir(dp)) != NULL)
+  {
+    if(!parse_name(e->d_name, &tmp)) continue;
+    for(wanted = all, k = 0; k < nits && !wanted; k++)
+      wanted = (its[k] == tmp.it);
+    if(!wanted) continue;
+    snprintf(tmp.path, sizeof(tmp.path), "%s/%s", dir, e->d_name);
+    if(nfiles == cap)
+    {
+      cap *= 2;
+      files = (rank_file *)realloc(files, cap*sizeof(rank_file));
+    }
+    files[nfiles++] = tmp;
+  }
+  closedir(dp);
+  if(nfiles == 0)
+  {
+    fprintf(stderr, "No solution files for the requested steps in %s\n", dir);
+    return 1;
+  }
+  qsort(files, nfiles, sizeof(rank_file), cmp_file);
+
+  // every file is independent, so read them all at once
+#pragma omp parallel for schedule(dynamic)
+  for(f = 0; f < nfiles; f++)
+    read_rank_file(&files[f]);
+  for(f = 0; f < nfiles; f++)
+    if(!files[f].ok)
+    {
+      fprintf(stderr, "Cannot read %s\n", files[f].path);
+      return 1;
+    }
+
+  // groups of files with the same step and suffix
+  for(g = 0; g < nfiles; g = h)
+  {
+    for(h = g; h < nfiles && files[h].it == files[g].it && strcmp(files[h].tag, files[g].tag) == 0; h++);
+    for(ntags = 0, k = 0; k < nfiles; k++)
+      if(files[k].it == files[g].it && (k == 0 || files[k-1].it != files[k].it || strcmp(files[k-1].tag, files[k].tag) != 0))
+        ntags++;
+    suffix[0] = '\0';
+    if(ntags > 1)
+    {
+      for(k = 0; files[g].tag[k] != '\0' && k < (int)sizeof(suffix)-1; k++)
+        suffix[k] = isalnum((unsigned char)files[g].tag[k]) || files[g].tag[k] == '_' ? files[g].tag[k] : 'x';
+      suffix[k] = '\0';
+    }
+    snprintf(outname, sizeof(outname), "%s/T_%06d%s.bin", outdir, files[g].it, suffix);
+    status |= assemble(&files[g], h - g, outname);
+  }
+
+  for(f = 0; f < nfiles; f++)
+    free(files[f].vals);
+  free(files);
+  free(its);
+  printf("%d file(s) in %.3f s\n", nfiles, wall_time() - t0);
+  return status;
+}